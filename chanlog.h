@@ -0,0 +1,267 @@
+/**
+ * File         : chanlog.h
+ * Purpose      : Logging to a file shared by several processes.
+ *
+ * Processes can't share a FileLogger's file without corrupting it. Instead
+ * each of them logs through a ChannelLogger, which writes every message as
+ * a single record into a shared memory log channel (see logchannel.h).
+ * One process, usually the service, runs a LogChannelPump which drains
+ * the channel into its own logger. The merged log keeps the order the
+ * messages were written in, each line prefixed with the time it was
+ * written at and the pid of the process that wrote it.
+ *
+ * Kept out of logfmwk.h as the channel needs C++11 atomics, which plain
+ * file logging has no use for.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include "logfmwk.h"
+#include "logchannel.h"
+
+#define LOGCHANNEL_RETRY_MS     1000	// interval between attempts to open the channel
+
+/*
+ * Logger specialization for writing messages to a shared memory log channel,
+ * to be drained into the log file by a LogChannelPump in another process
+ * (or the same one). This allows several processes, say multiple service
+ * instances and their helpers, to log to the one file.
+ *
+ * Channel name is derived from the log filename, so that constructing this
+ * with the same filename in all the processes gets them the same channel.
+ * Writes never block; messages are dropped if the channel is full. If the
+ * channel can't be opened, say as the service that creates it is yet to
+ * start, opening is retried every LOGCHANNEL_RETRY_MS and the number of
+ * messages lost in the meantime is logged once it succeeds.
+ */
+class ChannelLogger : public Logger {
+	ChannelLogger();
+	ChannelLogger(const ChannelLogger&);
+	ChannelLogger& operator=(const ChannelLogger&);
+public:
+    ChannelLogger(wchar_t const* filename)
+        : channel_()
+        , name_(getChannelName(filename))
+        , dwLastTry_(0)
+        , lost_(0)
+        , fReported_(false)
+    {
+        // records are timestamped by the pump
+        setTimeLines(false);
+        reopen();
+    }
+	/*
+	 * Returns the channel name for a log file, "Global\<filename>.channel"
+	 * where <filename> is the file's name without the path. Global, as the
+	 * service runs in a different session from the helper processes.
+	 */
+	static std::string getChannelName(wchar_t const* filename)
+	{
+		wchar_t szName[_MAX_FNAME]={0}, szExt[_MAX_EXT]={0};
+		::_wsplitpath_s(filename, NULL, 0, NULL, 0, szName, _countof(szName), szExt, _countof(szExt));
+		std::wstring name = std::wstring(szName)+szExt;
+		char szChannel[MAX_PATH] = {0};
+		::WideCharToMultiByte(CP_UTF8, 0, name.c_str(), -1, szChannel, _countof(szChannel)-1, NULL, NULL);
+		return std::string("Global\\")+szChannel+".channel";
+	}
+	bool isOpen() const
+	{ return channel_.isOpen(); }
+	// messages lost as the channel could not be opened
+	unsigned long getLostCount() const
+	{ return lost_; }
+    virtual void actualwrite(wchar_t const* msg) throw(std::exception)
+    {
+        if (!channel_.isOpen() && !reopen()) {
+            lost_++;
+            return;
+        }
+        channel_.write(msg, (uint32_t)(::wcslen(msg)*sizeof(wchar_t)));
+    }
+
+//Implementation
+private:
+	// Opens the channel, at most once every LOGCHANNEL_RETRY_MS. Called
+	// with the logger's lock held, except from the constructor.
+	bool reopen()
+	{
+		DWORD dwNow = ::GetTickCount();
+		if (dwLastTry_ != 0 && dwNow - dwLastTry_ < LOGCHANNEL_RETRY_MS)
+			return false;
+		dwLastTry_ = dwNow ? dwNow : 1;
+		if (!channel_.open(name_.c_str(), 4096, 256, true)) {
+			if (!fReported_) {
+				char szMsg[MAX_PATH+64] = {0};
+				::sprintf_s(szMsg, "ChannelLogger: failed to open %s, error %lu, will retry\n",
+					name_.c_str(), ::GetLastError());
+				::OutputDebugStringA(szMsg);
+				fReported_ = true;
+			}
+			return false;
+		}
+		fReported_ = false;
+		if (lost_) {
+			wchar_t szMsg[128] = {0};
+			::swprintf_s(szMsg, L"######## %lu MESSAGES LOST, CHANNEL WAS UNAVAILABLE ########\r\n", lost_);
+			channel_.write(szMsg, (uint32_t)(::wcslen(szMsg)*sizeof(wchar_t)));
+			lost_ = 0;
+		}
+		return true;
+	}
+
+private:
+    LogChannel channel_;
+    std::string name_;		// channel name
+    DWORD dwLastTry_;		// tick count of the last attempt to open, 0 if none
+    unsigned long lost_;	// messages lost while the channel was not open
+    bool fReported_;		// open failure has been reported
+};
+
+/*
+ * Drains a log channel into a logger, typically a FileLogger. Each record
+ * is prefixed with the local time it was written at and the pid of the
+ * process that wrote it, and so are the pump's own notes about discarded,
+ * parked and dropped records. Records are drained from a worker thread
+ * between start() and stop(), or by calling drain() directly after attach().
+ *
+ * There can be only one pump per channel, start() fails if another live
+ * process is already pumping the channel.
+ */
+class LogChannelPump : public LogChannelReader {
+	LogChannelPump();
+	LogChannelPump(const LogChannelPump&);
+	LogChannelPump& operator=(const LogChannelPump&);
+public:
+	// channel name is derived from the log filename, as in ChannelLogger
+	LogChannelPump(wchar_t const* filename, Logger& logger)
+		: LogChannelReader(channel_)
+		, channel_()
+		, name_(ChannelLogger::getChannelName(filename))
+		, logger_(logger)
+		, hThread_(NULL)
+		, hEventQuit_(NULL)
+		, dwPollMs_(10)
+	{
+		channel_.open(name_.c_str(), 4096, 256, true);
+		hEventQuit_ = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+	~LogChannelPump()
+	{
+		stop();
+		// has to be done here, the base destructor runs after channel_ is gone
+		detach();
+		::CloseHandle(hEventQuit_);
+	}
+
+	// starts the pump thread, which polls the channel every dwPollMs when idle
+	bool start(DWORD dwPollMs=10)
+	{
+		if (hThread_ != NULL)
+			return true;
+		if (!channel_.isOpen() && !channel_.open(name_.c_str(), 4096, 256, true))
+			return false;
+		if (!attach())
+			return false;
+		dwPollMs_ = dwPollMs;
+		::ResetEvent(hEventQuit_);
+		hThread_ = ::CreateThread(NULL, 0, _pumpProc, (LPVOID)this, 0, NULL);
+		return hThread_ != NULL;
+	}
+	// stops the pump thread and lets another process take over the channel
+	void stop()
+	{
+		if (hThread_ == NULL)
+			return;
+		::SetEvent(hEventQuit_);
+		::WaitForSingleObject(hThread_, INFINITE);
+		::CloseHandle(hThread_);
+		hThread_ = NULL;
+		// pick up the stragglers
+		drain();
+		detach();
+	}
+
+protected:
+	virtual void onrecord(const LogChannelRecord& rec, const void* data)
+	{
+		std::wostringstream os;
+		prefix(os, rec.timestamp, rec.pid);
+		os.write((const wchar_t*)data, rec.length/sizeof(wchar_t));
+		logger_.writeraw(os.str().c_str());
+	}
+	virtual void onabandoned(unsigned long pid, uint32_t cells)
+	{
+		wchar_t szMsg[128] = {0};
+		::swprintf_s(szMsg, L"######## PRODUCER DIED MID-RECORD, %u CELLS DISCARDED ########\r\n", cells);
+		note(pid, szMsg);
+	}
+	virtual void onstuck(unsigned long pid, uint32_t cells)
+	{
+		wchar_t szMsg[128] = {0};
+		::swprintf_s(szMsg, L"######## PRODUCER STUCK MID-RECORD, %u CELLS PARKED ########\r\n", cells);
+		note(pid, szMsg);
+	}
+	virtual void ondropped(uint64_t count)
+	{
+		wchar_t szMsg[128] = {0};
+		::swprintf_s(szMsg, L"######## CHANNEL FULL, %I64u RECORDS DROPPED ########\r\n", count);
+		note(::GetCurrentProcessId(), szMsg);
+	}
+
+//Implementation
+private:
+	static DWORD WINAPI _pumpProc(LPVOID lpParam)
+	{
+		reinterpret_cast<LogChannelPump*>(lpParam)->pump();
+		return 0;
+	}
+	void pump()
+	{
+		DWORD dwWait = 0;
+		while (::WaitForSingleObject(hEventQuit_, dwWait) == WAIT_TIMEOUT)
+			dwWait = drain() ? 0 : dwPollMs_;
+	}
+	// the time and pid columns every line starts with
+	static void prefix(std::wostringstream& os, uint64_t timestamp, unsigned long pid)
+	{
+		wchar_t szTime[32] = {0};
+		formatTimeStamp(timestamp, szTime, _countof(szTime));
+		os << szTime << L' ' << std::setw(6) << pid << L' ';
+	}
+	// a line of the pump's own, stamped with the current time
+	void note(unsigned long pid, wchar_t const* msg)
+	{
+		ULARGE_INTEGER li;
+		FILETIME ft;
+		::GetSystemTimeAsFileTime(&ft);
+		li.LowPart = ft.dwLowDateTime;
+		li.HighPart = ft.dwHighDateTime;
+		std::wostringstream os;
+		prefix(os, (li.QuadPart - 116444736000000000ULL)*100, pid);
+		os << msg;
+		logger_.writeraw(os.str().c_str());
+	}
+	// formats nanoseconds since the epoch as local time, YYYY/MM/DD HH:MM:SS.mmm
+	static void formatTimeStamp(uint64_t timestamp, wchar_t* szStamp, size_t nChars)
+	{
+		ULARGE_INTEGER li;
+		li.QuadPart = timestamp/100 + 116444736000000000ULL;	// FILETIME epoch is 1601
+		FILETIME ft = { li.LowPart, li.HighPart }, lft;
+		SYSTEMTIME st;
+		::FileTimeToLocalFileTime(&ft, &lft);
+		::FileTimeToSystemTime(&lft, &st);
+		::swprintf_s(szStamp, nChars, L"%04d/%02d/%02d %02d:%02d:%02d.%03d",
+			st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+	}
+
+private:
+	LogChannel channel_;	// constructed after the base, which only keeps a reference
+	std::string name_;		// channel name
+	Logger& logger_;		// where the records end up
+	HANDLE hThread_;		// pump thread
+	HANDLE hEventQuit_;		// signals the pump thread to quit
+	DWORD dwPollMs_;		// idle poll interval
+};
@@ -14,6 +14,7 @@
 #include <dbt.h>
 #include <crtdbg.h>
 #include "logfmwk.h"
+#include "watchdog.h"
 
 /*
 	TConsoleService is a class that encapsulates the logic of a 
@@ -44,6 +45,16 @@
 	This provides an effective means to debug the service as a console
 	program directly from Visual Studio, before running it as a service.
 
+	Hang detection is opt-in. Call enableWatchdog() from your constructor
+	and the base run() will send the run loop heartbeat. The run loop is
+	watched only while the base run() waits for the quit event, so your
+	initialization and deinitialization code around it may take as long
+	as it needs. If you write your own wait loop, do as the base run()
+	does: call beginRunLoop() before entering it, heartbeat() from it and
+	endRunLoop() once it exits. Worker threads can register themselves
+	through registerWorker() and then call heartbeat(id) from their own
+	loops. Stalls are logged and passed on to onStall().
+
 	Here's sample client code:
 
 	class MyServicePrgram : public TConsoleService<FileLogger>
@@ -101,6 +112,10 @@ public:
 		, hEventQuit_(NULL)
 		, fDebugMode_(false)
 		, logger_(getLogFilename(lpszServiceName).c_str())
+		, watchdog_(logger_)
+		, iRunLoop_(-1)
+		, dwWatchdogDeadlineMs_(0)
+		, dwStallExitCode_(0)
 	{
 		::ZeroMemory((PVOID)&status_, sizeof(SERVICE_STATUS));
         ::ZeroMemory((PVOID)szServiceName_, sizeof(szServiceName_));
@@ -182,9 +197,14 @@ public:
 		status_.dwCheckPoint = 0;
 		status_.dwWaitHint = 0;
 
+		if (isWatchdogEnabled())
+			watchdog_.start(dwWatchdogDeadlineMs_/4, _stallHandler, (LPVOID)this);
+
 		// When the Run function returns, the service has stopped.
 		status_.dwWin32ExitCode = run();
 
+		watchdog_.stop();
+
 		setServiceStatus(SERVICE_STOPPED);
 	}
 
@@ -196,7 +216,12 @@ public:
 
 		// Wait for the quit event to be signalled. Event would be signalled either from 
 		// the SERVICE_STOP control handler or from the Ctrl+C control handler.
-        ::WaitForSingleObject(hEventQuit_, INFINITE);
+		// With the watchdog enabled, wake up periodically to send the heartbeat.
+		DWORD dwTimeout = isWatchdogEnabled() ? dwWatchdogDeadlineMs_/2 : INFINITE;
+		beginRunLoop();
+		while (::WaitForSingleObject(hEventQuit_, dwTimeout) == WAIT_TIMEOUT)
+			heartbeat();
+		endRunLoop();
 
 		return 0;
 	}
@@ -208,6 +233,61 @@ public:
 	Logger& getLogger()
 	{ return logger_; }
 
+	/**
+	 * Enables the watchdog. dwDeadlineMs is the longest the run loop may
+	 * go without a heartbeat and also the longest the logger may hold its
+	 * lock. If dwStallExitCode is non-zero, a stall stops the service with
+	 * it as the service specific exit code. Call before run() gets control.
+	 * A dwDeadlineMs of 0 leaves the watchdog disabled. Returns false, and
+	 * leaves the watchdog disabled, if dwDeadlineMs is non-zero but less
+	 * than MIN_WATCHDOG_DEADLINE_MS.
+	 */
+	bool enableWatchdog(DWORD dwDeadlineMs, DWORD dwStallExitCode=0)
+	{
+		bool fValid = dwDeadlineMs == 0 || dwDeadlineMs >= MIN_WATCHDOG_DEADLINE_MS;
+		if (!fValid)
+			dwDeadlineMs = 0;
+		dwWatchdogDeadlineMs_ = dwDeadlineMs;
+		dwStallExitCode_ = dwStallExitCode;
+		watchdog_.setLoggerDeadline(dwDeadlineMs);
+		if (dwDeadlineMs != 0)
+			watchdog_.setEventSource(szServiceName_);
+		return fValid;
+	}
+
+	bool isWatchdogEnabled()
+	{ return dwWatchdogDeadlineMs_ != 0; }
+
+	/*
+	 * Arms and disarms the run loop heartbeat. The base run() calls these
+	 * around its wait loop; call them around your own if you replace it.
+	 */
+	void beginRunLoop() throw()
+	{
+		if (isWatchdogEnabled() && iRunLoop_ < 0)
+			iRunLoop_ = watchdog_.add(L"runloop", dwWatchdogDeadlineMs_);
+	}
+
+	void endRunLoop() throw()
+	{
+		watchdog_.remove(iRunLoop_);
+		iRunLoop_ = -1;
+	}
+
+	/* register worker threads with the watchdog, returns -1 on failure */
+	int registerWorker(const wchar_t* lpszName, DWORD dwDeadlineMs)
+	{ return watchdog_.add(lpszName, dwDeadlineMs); }
+
+	void unregisterWorker(int id)
+	{ watchdog_.remove(id); }
+
+	/* heartbeats, for the run loop and the registered workers respectively */
+	void heartbeat() throw()
+	{ watchdog_.beat(iRunLoop_); }
+
+	void heartbeat(int id) throw()
+	{ watchdog_.beat(id); }
+
 	/* returns a std::wstring with the log file's fullname, including path */
 	virtual std::wstring getLogFilename(const wchar_t* lpszServicename) const
 	{
@@ -277,6 +357,33 @@ public:
 	{
 	}
 
+	/**
+	 * Called from the watchdog thread when the run loop, a worker or the
+	 * logger misses its deadline. Diagnostics have already been logged,
+	 * to the event log if the logger was locked.
+	 * Default escalation, if a stall exit code was given, is to report
+	 * SERVICE_STOPPED with that code and terminate. A graceful stop is
+	 * not an option as the stalled thread may never return. For the SCM
+	 * recovery actions to kick in, the service's failure actions flag
+	 * (SERVICE_CONFIG_FAILURE_ACTIONS_FLAG) has to be set.
+	 */
+	virtual void onStall(const wchar_t* /*lpszParticipant*/, DWORD /*dwStalledMs*/) throw()
+	{
+		if (dwStallExitCode_ == 0)
+			return;
+		// the service thread may be updating status_, report from a copy
+		SERVICE_STATUS status = status_;
+		status.dwCurrentState = SERVICE_STOPPED;
+		status.dwControlsAccepted = 0;
+		status.dwWin32ExitCode = ERROR_SERVICE_SPECIFIC_ERROR;
+		status.dwServiceSpecificExitCode = dwStallExitCode_;
+		status.dwCheckPoint = 0;
+		status.dwWaitHint = 0;
+		if (!isDebugMode())
+			::SetServiceStatus(hServiceStatus_, &status);
+		::TerminateProcess(::GetCurrentProcess(), dwStallExitCode_);
+	}
+
 	void setServiceStatus(DWORD dwState) throw()
 	{
 		status_.dwCurrentState = dwState;
@@ -346,6 +453,10 @@ protected:
 		}
         return dwRet;
 	}
+	static void CALLBACK _stallHandler(LPVOID lpContext, const wchar_t* lpszParticipant, DWORD dwStalledMs)
+	{
+		reinterpret_cast<TConsoleService*>(lpContext)->onStall(lpszParticipant, dwStalledMs);
+	}
 	static BOOL WINAPI _consoleCtrlHandler(DWORD dwCtrlType)
 	{
 		return s_pProgram->consoleCtrlHandler(dwCtrlType);
@@ -369,6 +480,10 @@ protected:
 	SERVICE_STATUS status_;	// service's current status
 	bool fDebugMode_;			// set to true if /debug was specified
 	TLogger logger_;	// default logger
+	Watchdog watchdog_;	// hang detection, inactive unless enabled
+	int iRunLoop_;		// run loop's watchdog slot, -1 outside the wait loop
+	DWORD dwWatchdogDeadlineMs_;	// run loop heartbeat deadline, 0 if disabled
+	DWORD dwStallExitCode_;	// service specific exit code on a stall
 
 	// Pointer to one and only instance of this class per program!
 	// Remember to initialize this to NULL from your CPP file, or else
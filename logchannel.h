@@ -0,0 +1,695 @@
+/**
+ * File         : logchannel.h
+ * Purpose      : Cross-process log channel over shared memory.
+ *
+ * Several processes on a host can't share a log file without trampling
+ * over each other's writes. Instead, they each write their log records
+ * into a named shared memory ring buffer and a single reader process
+ * drains the ring into the one log file. As all producers reserve their
+ * records from the same ring, the reader sees them in the order they were
+ * written, merged across processes.
+ *
+ * The ring is an array of fixed size cells, a record taking up one or
+ * more consecutive cells. Every cell carries a sequence word, which tells
+ * the state of the cell with respect to a ring position pos:
+ *
+ *		seqFree(pos)			cell is free to be written at pos
+ *		seqWriting(pid)			cell is being written by pid
+ *		seqCommitted(pos)		record starting at pos has been committed
+ *		seqFree(pos+cellCount)	cell has been read, free for the next lap
+ *		seqParked(pid)			cell set aside, as pid got stuck writing it
+ *
+ * Producers reserve a record's cells by a compare-and-swap on the shared
+ * enqueue position, then take each of the cells by swapping their pid into
+ * its sequence word, copy the payload and commit the record. No locks are
+ * taken, so a producer can never block another producer. If the ring is
+ * full the record is dropped and counted.
+ *
+ * The reader waits on a record that is being written for as long as its
+ * writer is alive, and discards it once the writer is gone. A record that
+ * has been reserved but whose first cell no writer has taken -- the writer
+ * died right after reserving -- is discarded after a timeout, by swapping
+ * the cell to its next lap's free state. A writer that turns up late then
+ * fails to take the cell and drops the record. A reader can die too, even
+ * halfway through handing back a record's cells, in which case the next
+ * reader to attach skips over the cells that have already been read.
+ *
+ * A writer can also be alive but stuck, say suspended in a debugger, in
+ * the middle of a record. Every producer's records would queue up behind
+ * it, so after a while the reader gives up on the record. The cells can't
+ * be reused while the writer may still write to them, so they are parked
+ * instead: the reader and the producers step over them on every lap until
+ * the writer, once it gets going again, marks them done, or dies. Only
+ * then does the reader free them. Pid reuse is caught by checking when
+ * the process by the pid was started against when the record was.
+ *
+ * The code here is portable, built on SharedMemory, so that it can be
+ * stress tested with multiple processes on Linux as well.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include "shmem.h"
+
+#define LOGCHANNEL_MAGIC        0x43474f4c	// 'LOGC'
+#define LOGCHANNEL_VERSION      2
+#define LOGCHANNEL_TIMEOUT_MS   5000		// default wait on a reservation no writer took
+#define LOGCHANNEL_HUNG_MS      5000		// default wait on a live writer
+
+// atomics that are not lock-free use process local locks, useless here
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+	"logchannel requires lock-free 32 and 64-bit atomics");
+
+/*
+ * Shared segment layout. Segment is mapped at different addresses in
+ * different processes, so nothing in here may hold a pointer. The hot
+ * positions get a cache line each.
+ */
+struct LogChannelHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t cellCount;						// power of 2
+	uint32_t cellSize;						// bytes, including LogChannelCell
+	std::atomic<uint32_t> ready;			// set once the creator is done
+	std::atomic<uint32_t> readerPid;		// the one reader, 0 if none
+	char pad0[40];
+	std::atomic<uint64_t> enqueuePos;		// next position to reserve
+	char pad1[56];
+	std::atomic<uint64_t> dequeuePos;		// next position to read
+	char pad2[56];
+	std::atomic<uint64_t> dropped;			// records dropped, ring was full
+	char pad3[56];
+};
+
+// Every cell starts with this. seq, claim and timestamp are set in every
+// cell a writer takes, the rest only in the first cell of a record.
+// Payload follows.
+struct LogChannelCell {
+	std::atomic<uint64_t> seq;				// state, see above
+	std::atomic<uint64_t> claim;			// position the cell was taken at
+	uint32_t pid;							// owner of the record
+	uint32_t tid;
+	uint64_t timestamp;						// nanoseconds since the epoch
+	uint32_t length;						// payload bytes
+	uint32_t cells;							// cells taken up by the record
+};
+
+// a record, as handed out by the reader
+struct LogChannelRecord {
+	unsigned long pid;
+	unsigned long tid;
+	uint64_t timestamp;						// nanoseconds since the epoch
+	uint32_t length;						// payload bytes
+};
+
+/*
+ * Attaches to a channel, creating it if need be, and writes records to it.
+ * All processes using a channel must agree on its geometry.
+ */
+class LogChannel {
+	friend class LogChannelReader;
+
+	LogChannel(const LogChannel&);
+	LogChannel& operator=(const LogChannel&);
+public:
+	// cell sequence words, see above
+	static const uint64_t SEQ_WRITING = (uint64_t)1 << 63;
+	static const uint64_t SEQ_PARKED = (uint64_t)1 << 62;
+	static const uint64_t SEQ_DONE = (uint64_t)1 << 61;	// parked, writer is done with it
+	static uint64_t seqFree(uint64_t pos)
+	{ return pos << 1; }
+	static uint64_t seqCommitted(uint64_t pos)
+	{ return (pos << 1) | 1; }
+	static uint64_t seqWriting(unsigned long pid)
+	{ return SEQ_WRITING | (uint32_t)pid; }
+	static uint64_t seqParked(unsigned long pid)
+	{ return SEQ_PARKED | (uint32_t)pid; }
+	static bool isWriting(uint64_t seq)
+	{ return (seq & SEQ_WRITING) != 0; }
+	static bool isParked(uint64_t seq)
+	{ return (seq & (SEQ_WRITING|SEQ_PARKED)) == SEQ_PARKED; }
+	// pid in a writing or parked sequence word
+	static unsigned long ownerOf(uint64_t seq)
+	{ return (unsigned long)(uint32_t)seq; }
+
+	LogChannel()
+		: shm_()
+		, header_(0)
+		, cells_(0)
+		, cellCount_(0)
+		, cellSize_(0)
+	{}
+	~LogChannel()
+	{ close(); }
+
+	/*
+	 * Opens the named channel. cellCount has to be a power of 2 and
+	 * cellSize a multiple of 8, large enough to hold some payload.
+	 * fAllUsers opens up a channel created by this call to all users,
+	 * see SharedMemory::open().
+	 */
+	bool open(const char* name, uint32_t cellCount=4096, uint32_t cellSize=256, bool fAllUsers=false)
+	{
+		close();
+		if (cellCount < 4 || (cellCount & (cellCount-1)) != 0
+			|| cellSize % 8 != 0 || cellSize <= sizeof(LogChannelCell))
+			return false;
+
+		if (!shm_.open(name, sizeof(LogChannelHeader) + (size_t)cellCount*cellSize, fAllUsers))
+			return false;
+		LogChannelHeader* header = (LogChannelHeader*)shm_.data();
+		char* cells = (char*)shm_.data() + sizeof(LogChannelHeader);
+
+		if (shm_.isCreator()) {
+			new (header) LogChannelHeader();
+			header->magic = LOGCHANNEL_MAGIC;
+			header->version = LOGCHANNEL_VERSION;
+			header->cellCount = cellCount;
+			header->cellSize = cellSize;
+			header->readerPid.store(0);
+			header->enqueuePos.store(0);
+			header->dequeuePos.store(0);
+			header->dropped.store(0);
+			for (uint32_t i=0; i<cellCount; i++) {
+				LogChannelCell* cell = new (cells + (size_t)i*cellSize) LogChannelCell();
+				cell->seq.store(seqFree(i), std::memory_order_relaxed);
+				cell->claim.store(~(uint64_t)0, std::memory_order_relaxed);
+			}
+			header->ready.store(1, std::memory_order_release);
+		} else {
+			// wait for the creator to finish setting it up
+			int i = 0;
+			for (; i<1000 && header->ready.load(std::memory_order_acquire) == 0; i++)
+				SharedMemory::sleep(1);
+			if (i == 1000
+				|| header->magic != LOGCHANNEL_MAGIC
+				|| header->version != LOGCHANNEL_VERSION
+				|| header->cellCount != cellCount
+				|| header->cellSize != cellSize) {
+				shm_.close();
+				return false;
+			}
+		}
+		header_ = header;
+		cells_ = cells;
+		cellCount_ = cellCount;
+		cellSize_ = cellSize;
+		return true;
+	}
+	void close()
+	{
+		shm_.close();
+		header_ = 0;
+		cells_ = 0;
+	}
+	bool isOpen() const
+	{ return header_ != 0; }
+
+	// largest record that can be written, longer ones are truncated
+	uint32_t getMaxRecordSize() const
+	{ return getMaxCells() * getPayloadSize(); }
+
+	// records dropped so far, since the reader last picked up the count
+	uint64_t getDroppedCount() const
+	{ return header_ ? header_->dropped.load(std::memory_order_relaxed) : 0; }
+
+	/*
+	 * Writes a record. Never blocks; returns false if the record had to be
+	 * dropped, because the ring was full, the reader gave up waiting on us
+	 * or the channel is not open.
+	 */
+	bool write(const void* pData, uint32_t cbData)
+	{
+		if (!header_)
+			return false;
+
+		uint32_t cbPayload = getPayloadSize();
+		if (cbData > getMaxRecordSize())
+			cbData = getMaxRecordSize();
+		uint32_t cells = cbData ? (cbData + cbPayload - 1) / cbPayload : 1;
+
+		// reserve the cells, all of them have to be free for this lap
+		uint64_t pos = header_->enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			uint32_t i = 0;
+			uint64_t seq = 0;
+			for (; i<cells; i++) {
+				seq = cell(pos + i)->seq.load(std::memory_order_acquire);
+				if (seq != seqFree(pos + i))
+					break;
+			}
+			if (i == cells) {
+				if (header_->enqueuePos.compare_exchange_weak(pos, pos + cells, std::memory_order_relaxed))
+					break;
+				continue;
+			}
+			if (isParked(seq)) {
+				// step over the parked cell, handing back the ones before it
+				if (header_->enqueuePos.compare_exchange_weak(pos, pos + i + 1, std::memory_order_relaxed)) {
+					handback(pos, i + 1);
+					pos += i + 1;
+				}
+				continue;
+			}
+			// still in use from the previous lap, unless our pos is stale
+			uint64_t current = header_->enqueuePos.load(std::memory_order_relaxed);
+			if (current == pos) {
+				header_->dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			pos = current;
+		}
+
+		// Take the cells, with our pid on them so that the reader can tell
+		// if we die. Fails if we took so long that the reader gave up on us.
+		unsigned long pid = SharedMemory::currentProcessId();
+		uint64_t timestamp = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		for (uint32_t i=0; i<cells; i++) {
+			LogChannelCell* taken = cell(pos + i);
+			uint64_t expected = seqFree(pos + i);
+			if (!taken->seq.compare_exchange_strong(expected, seqWriting(pid), std::memory_order_acquire, std::memory_order_relaxed)) {
+				for (uint32_t j=0; j<i; j++)
+					abandon(pos + j, pid);
+				handback(pos + i + 1, cells - i - 1);
+				header_->dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			taken->timestamp = timestamp;
+			taken->claim.store(pos + i, std::memory_order_release);
+		}
+		LogChannelCell* first = cell(pos);
+		first->pid = (uint32_t)pid;
+		first->tid = (uint32_t)SharedMemory::currentThreadId();
+		first->length = cbData;
+		first->cells = cells;
+
+		const char* pSrc = (const char*)pData;
+		for (uint32_t i=0; i<cells; i++) {
+			uint32_t cb = cbData > cbPayload ? cbPayload : cbData;
+			::memcpy(payload(cell(pos + i)), pSrc, cb);
+			pSrc += cb;
+			cbData -= cb;
+		}
+
+		// Commit, unless the reader parked the cells while we were stuck.
+		// The cells after the first are left to the reader as they were
+		// when reserved; it only ever gets to them past the first.
+		bool fParked = false;
+		for (uint32_t i=1; i<cells; i++) {
+			uint64_t expected = seqWriting(pid);
+			if (!cell(pos + i)->seq.compare_exchange_strong(expected, seqFree(pos + i), std::memory_order_release, std::memory_order_relaxed)) {
+				fParked = true;
+				abandon(pos + i, pid);
+			}
+		}
+		uint64_t expected = seqWriting(pid);
+		if (!fParked && first->seq.compare_exchange_strong(expected, seqCommitted(pos), std::memory_order_release, std::memory_order_relaxed))
+			return true;
+		abandon(pos, pid);
+		handback(pos + 1, cells - 1);
+		header_->dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+//Implementation
+protected:
+	LogChannelCell* cell(uint64_t pos) const
+	{ return (LogChannelCell*)(cells_ + (size_t)(pos & (cellCount_-1)) * cellSize_); }
+	static char* payload(LogChannelCell* cell)
+	{ return (char*)cell + sizeof(LogChannelCell); }
+	uint32_t getPayloadSize() const
+	{ return cellSize_ - (uint32_t)sizeof(LogChannelCell); }
+	// a record may take up at most a quarter of the ring
+	uint32_t getMaxCells() const
+	{ return cellCount_ / 4; }
+
+	// hands back reserved cells that won't be written, as if read
+	void handback(uint64_t pos, uint32_t cells)
+	{
+		for (uint32_t i=0; i<cells; i++) {
+			uint64_t expected = seqFree(pos + i);
+			cell(pos + i)->seq.compare_exchange_strong(expected, seqFree(pos + i + cellCount_), std::memory_order_acq_rel);
+		}
+	}
+	// Gives up a cell we took at pos, handing it back as if read. If the
+	// reader parked it while we were stuck, marks it done instead. Either
+	// way the cell is ours until then, no one else touches it.
+	void abandon(uint64_t pos, unsigned long pid)
+	{
+		LogChannelCell* c = cell(pos);
+		uint64_t expected = seqWriting(pid);
+		if (!c->seq.compare_exchange_strong(expected, seqFree(pos + cellCount_), std::memory_order_acq_rel))
+			c->seq.compare_exchange_strong(expected, expected | SEQ_DONE, std::memory_order_release, std::memory_order_relaxed);
+	}
+
+private:
+	SharedMemory shm_;
+	LogChannelHeader* header_;	// in shm_, NULL if not open
+	char* cells_;				// in shm_, right after the header
+	uint32_t cellCount_;
+	uint32_t cellSize_;
+};
+
+/*
+ * Drains a channel. Derive from this and override onrecord() to do
+ * something with the records. There can be only one reader per channel,
+ * across all processes.
+ */
+class LogChannelReader {
+	LogChannelReader();
+	LogChannelReader(const LogChannelReader&);
+	LogChannelReader& operator=(const LogChannelReader&);
+public:
+	/*
+	 * dwTimeoutMs is how long to wait on a reserved record that no writer
+	 * has taken up, before giving up on it. dwHungMs is how long to wait
+	 * on a live writer in the middle of a record, before parking it.
+	 */
+	LogChannelReader(LogChannel& channel, unsigned int dwTimeoutMs=LOGCHANNEL_TIMEOUT_MS, unsigned int dwHungMs=LOGCHANNEL_HUNG_MS)
+		: channel_(channel)
+		, dwTimeoutMs_(dwTimeoutMs)
+		, dwHungMs_(dwHungMs)
+		, fAttached_(false)
+		, stuckPos_(~(uint64_t)0)
+		, stuckSeq_(0)
+		, stuckSince_(0)
+		, stuckEnd_(0)
+		, hungPid_(0)
+		, hungAt_(0)
+		, parked_(0)
+		, fScan_(false)
+		, lastScan_(0)
+	{}
+	virtual ~LogChannelReader()
+	{ detach(); }
+
+	/*
+	 * Makes this the channel's reader. Fails if another reader, in this
+	 * process or another live one, is attached. Takes over from a reader
+	 * that died.
+	 */
+	bool attach()
+	{
+		if (fAttached_)
+			return true;
+		if (!channel_.isOpen())
+			return false;
+		uint32_t me = (uint32_t)SharedMemory::currentProcessId();
+		uint32_t current = channel_.header_->readerPid.load();
+		while (current == 0 || (current != me && !SharedMemory::isProcessAlive(current))) {
+			if (channel_.header_->readerPid.compare_exchange_strong(current, me)) {
+				fAttached_ = true;
+				stuckPos_ = ~(uint64_t)0;
+				hungPid_ = 0;
+				// a previous reader may have left cells parked
+				fScan_ = true;
+				return true;
+			}
+		}
+		return false;
+	}
+	void detach()
+	{
+		if (!fAttached_)
+			return;
+		fAttached_ = false;
+		if (channel_.isOpen()) {
+			uint32_t me = (uint32_t)SharedMemory::currentProcessId();
+			channel_.header_->readerPid.compare_exchange_strong(me, 0);
+		}
+	}
+	bool isAttached() const
+	{ return fAttached_; }
+
+	// cells parked as of the last check, see above
+	uint32_t getParkedCount() const
+	{ return parked_; }
+
+	/*
+	 * Reads up to maxRecords records, handing each to onrecord() in the
+	 * order they were written. Returns the number of records read. Stops
+	 * early at a record that is yet to be committed.
+	 */
+	size_t drain(size_t maxRecords = (size_t)-1)
+	{
+		if (!fAttached_)
+			return 0;
+
+		LogChannelHeader* header = channel_.header_;
+		uint64_t dropped = header->dropped.exchange(0, std::memory_order_relaxed);
+		if (dropped)
+			ondropped(dropped);
+		if (fScan_ || (parked_ && now() - lastScan_ >= dwTimeoutMs_))
+			unpark();
+
+		size_t n = 0;
+		while (n < maxRecords) {
+			uint64_t pos = header->dequeuePos.load(std::memory_order_relaxed);
+			if (pos == header->enqueuePos.load(std::memory_order_acquire))
+				break;
+
+			LogChannelCell* first = channel_.cell(pos);
+			uint64_t seq = first->seq.load(std::memory_order_acquire);
+			if (seq != LogChannel::seqCommitted(pos)) {
+				if (!recover(pos, seq))
+					break;
+				continue;
+			}
+
+			// committed, copy it out and hand the cells back
+			uint32_t cells = first->cells;
+			if (cells == 0 || cells > channel_.getMaxCells())
+				cells = 1;
+			uint32_t cbPayload = channel_.getPayloadSize();
+			LogChannelRecord rec;
+			rec.pid = first->pid;
+			rec.tid = first->tid;
+			rec.timestamp = first->timestamp;
+			rec.length = first->length;
+			if (rec.length > cells * cbPayload)
+				rec.length = cells * cbPayload;
+			buffer_.resize(rec.length + 1);
+			char* pDst = &buffer_[0];
+			uint32_t cbLeft = rec.length;
+			for (uint32_t i=0; i<cells; i++) {
+				uint32_t cb = cbLeft > cbPayload ? cbPayload : cbLeft;
+				::memcpy(pDst, LogChannel::payload(channel_.cell(pos + i)), cb);
+				pDst += cb;
+				cbLeft -= cb;
+			}
+			release(pos, cells);
+
+			onrecord(rec, &buffer_[0]);
+			n++;
+		}
+		return n;
+	}
+
+protected:
+	// a record, data is rec.length bytes
+	virtual void onrecord(const LogChannelRecord& rec, const void* data) = 0;
+	// an uncommitted record was discarded, pid is 0 if the owner is unknown
+	virtual void onabandoned(unsigned long /*pid*/, uint32_t /*cells*/)
+	{}
+	// a live writer was stuck mid-record, its cells were parked
+	virtual void onstuck(unsigned long /*pid*/, uint32_t /*cells*/)
+	{}
+	// records were dropped by producers as the ring was full
+	virtual void ondropped(uint64_t /*count*/)
+	{}
+
+//Implementation
+private:
+	static uint64_t now()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	static uint64_t wallclock()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+	// is position p in a lap after the one pos is in?
+	bool isLaterLap(uint64_t p, uint64_t pos) const
+	{ return (int64_t)(p - pos) >= (int64_t)channel_.cellCount_; }
+	// moves past the cells without touching them
+	void skip(uint64_t pos, uint64_t cells)
+	{
+		channel_.header_->dequeuePos.store(pos + cells, std::memory_order_release);
+		stuckPos_ = ~(uint64_t)0;
+	}
+	// marks the cells as read and moves past them
+	void release(uint64_t pos, uint32_t cells)
+	{
+		for (uint32_t i=0; i<cells; i++)
+			channel_.cell(pos + i)->seq.store(LogChannel::seqFree(pos + i + channel_.cellCount_), std::memory_order_release);
+		skip(pos, cells);
+	}
+	// Cells from pos on taken by the same writer for the same record, as
+	// the one at pos, whose sequence word is seq.
+	uint32_t countTaken(uint64_t pos, uint64_t seq) const
+	{
+		LogChannelCell* first = channel_.cell(pos);
+		if (first->claim.load(std::memory_order_acquire) != pos)
+			return 1;
+		uint64_t timestamp = first->timestamp;
+		uint32_t n = 1;
+		for (; n<channel_.getMaxCells(); n++) {
+			LogChannelCell* c = channel_.cell(pos + n);
+			if (c->seq.load(std::memory_order_acquire) != seq
+				|| c->claim.load(std::memory_order_acquire) != pos + n
+				|| c->timestamp != timestamp)
+				break;
+		}
+		return n;
+	}
+	// starts or keeps timing the wait on pos
+	uint64_t waited(uint64_t pos, uint64_t seq)
+	{
+		if (stuckPos_ != pos || stuckSeq_ != seq) {
+			stuckPos_ = pos;
+			stuckSeq_ = seq;
+			stuckSince_ = now();
+			stuckEnd_ = channel_.header_->enqueuePos.load(std::memory_order_acquire);
+		}
+		return now() - stuckSince_;
+	}
+	// Deals with the uncommitted cell at pos, seq being its sequence word.
+	// Returns true if the caller should have another go at pos, false if
+	// it should wait.
+	bool recover(uint64_t pos, uint64_t seq)
+	{
+		if (LogChannel::isWriting(seq))
+			return recoverWriting(pos, seq);
+		if (seq != LogChannel::seqFree(pos)) {
+			// Parked on an earlier lap, or read already by a reader that
+			// died before it could move past it. Nothing is coming at pos
+			// in this lap, and the cell may be in use, so only move on.
+			skip(pos, 1);
+			return true;
+		}
+
+		// reserved, but no writer has taken the first cell yet
+		if (waited(pos, seq) < dwTimeoutMs_)
+			return false;
+
+		// Writer died, or is taking its time, right after reserving. Cells
+		// reserved before we started waiting that are still free can go, a
+		// writer that turns up late will fail to take its first cell.
+		uint64_t end = pos;
+		uint64_t expected = LogChannel::seqFree(end);
+		while (end < stuckEnd_
+			&& channel_.cell(end)->seq.compare_exchange_strong(expected,
+				LogChannel::seqFree(end + channel_.cellCount_), std::memory_order_acq_rel)) {
+			end++;
+			expected = LogChannel::seqFree(end);
+		}
+		if (end == pos)
+			return true;	// taken in the meantime, have another look
+		skip(pos, end - pos);
+		onabandoned(0, (uint32_t)(end - pos));
+		return true;
+	}
+	bool recoverWriting(uint64_t pos, uint64_t seq)
+	{
+		LogChannelCell* c = channel_.cell(pos);
+		unsigned long pid = LogChannel::ownerOf(seq);
+		uint64_t claim = c->claim.load(std::memory_order_acquire);
+		if (claim != ~(uint64_t)0 && isLaterLap(claim, pos)) {
+			// next lap's, this one was read by a reader that died before it
+			// could move past it
+			skip(pos, 1);
+			return true;
+		}
+		// the timestamp is good once the claim is
+		uint64_t timestamp = claim == pos ? c->timestamp : 0;
+
+		if (!SharedMemory::isProcessAlive(pid, timestamp)) {
+			// Writer is gone, hand back what it had taken. If it died before
+			// taking all of its cells, the rest are picked up as not taken.
+			uint32_t n = countTaken(pos, seq);
+			release(pos, n);
+			onabandoned(pid, n);
+			return true;
+		}
+
+		// Alive, wait on it for a while. Records the writer started before
+		// we found it stuck last, aren't waited on again.
+		bool fHung = pid == hungPid_ && timestamp != 0 && timestamp < hungAt_;
+		if (!fHung && waited(pos, seq) < dwHungMs_)
+			return false;
+
+		// Stuck mid-record, suspended in a debugger say. Park the cells so
+		// that the others can get on with it; the writer marks them done,
+		// and drops the record, when it gets going again.
+		uint32_t n = countTaken(pos, seq);
+		uint32_t parked = 0;
+		for (; parked<n; parked++) {
+			uint64_t expected = seq;
+			if (!channel_.cell(pos + parked)->seq.compare_exchange_strong(expected,
+					LogChannel::seqParked(pid), std::memory_order_acq_rel))
+				break;
+		}
+		if (parked == 0)
+			return true;	// committed in the meantime, have another look
+		skip(pos, parked);
+		parked_ += parked;
+		if (!fHung) {
+			hungPid_ = pid;
+			hungAt_ = wallclock();
+		}
+		onstuck(pid, parked);
+		return true;
+	}
+	// Frees the parked cells whose writer is done with them, or gone. A
+	// freed cell is made free for the first lap producers are yet to get
+	// to; one that steps over it in the meantime hands it back.
+	void unpark()
+	{
+		LogChannelHeader* header = channel_.header_;
+		uint32_t cellCount = channel_.cellCount_;
+		uint32_t parked = 0;
+		for (uint32_t i=0; i<cellCount; i++) {
+			LogChannelCell* c = channel_.cell(i);
+			uint64_t seq = c->seq.load(std::memory_order_acquire);
+			if (!LogChannel::isParked(seq))
+				continue;
+			if (!(seq & LogChannel::SEQ_DONE) && SharedMemory::isProcessAlive(LogChannel::ownerOf(seq))) {
+				parked++;
+				continue;
+			}
+			uint64_t end = header->enqueuePos.load(std::memory_order_acquire);
+			uint64_t next = end + (((uint64_t)i - end) & (cellCount - 1));
+			if (!c->seq.compare_exchange_strong(seq, LogChannel::seqFree(next), std::memory_order_acq_rel))
+				parked++;	// just marked done, next time
+		}
+		parked_ = parked;
+		fScan_ = false;
+		lastScan_ = now();
+	}
+
+private:
+	LogChannel& channel_;
+	unsigned int dwTimeoutMs_;	// wait on a record no writer has taken
+	unsigned int dwHungMs_;		// wait on a live writer
+	bool fAttached_;			// this is the channel's reader
+	uint64_t stuckPos_;			// uncommitted cell being waited on
+	uint64_t stuckSeq_;			// and its sequence word at the time
+	uint64_t stuckSince_;		// when we started waiting on it, ms
+	uint64_t stuckEnd_;			// enqueue position at the time
+	unsigned long hungPid_;		// writer last found stuck
+	uint64_t hungAt_;			// and when, nanoseconds since the epoch
+	uint32_t parked_;			// parked cells, as of the last scan
+	bool fScan_;				// parked cells need a look
+	uint64_t lastScan_;			// when they had the last look, ms
+	std::vector<char> buffer_;	// current record
+};
@@ -0,0 +1,451 @@
+/**
+ * File         : logchannel_stress.cpp
+ * Purpose      : Multi-process stress test for the log channel, POSIX only.
+ *
+ * Build and run from the repository root:
+ *
+ *     g++ -std=c++11 -O2 -pthread -I. logchannel_stress.cpp -o logchannel_stress -lrt
+ *     ./logchannel_stress
+ *
+ * Forks a number of producer processes, each writing sequence numbered
+ * records of varying length from several threads, while the parent drains
+ * the channel. Every record is checked for corruption and for being in
+ * order with the previous record from the same thread. On top of that,
+ * the awkward cases are forced:
+ *
+ *		- a producer is killed with SIGKILL halfway through
+ *		- a producer dies right after reserving, before taking the first cell
+ *		- a producer dies after taking the first cell, before committing
+ *		- a producer stops, with SIGSTOP, in the middle of a record and
+ *		  stays stopped until killed
+ *		- producers stop in the middle of records over and over, and are
+ *		  continued after a while
+ *		- a reader dies halfway through handing back a record's cells
+ *		  and another process takes over as the reader
+ *
+ * Exits with 0 if all is well. A reader that spins is caught by alarm().
+ */
+
+#include "logchannel.h"
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <vector>
+
+static const char* CHANNEL_NAME = "Global\\logchannel_stress";
+static const uint32_t CELL_COUNT = 1024;
+static const uint32_t CELL_SIZE = 128;
+static const unsigned int TIMEOUT_MS = 200;
+static const unsigned int HUNG_MS = 300;
+
+static const int PRODUCERS = 6;
+static const int THREADS = 4;
+static const long RECORDS = 20000;		// per thread
+
+/*
+ * Reader that checks the records written by produce()
+ */
+class CheckingReader : public LogChannelReader {
+public:
+	CheckingReader(LogChannel& channel, unsigned int dwHungMs=HUNG_MS)
+		: LogChannelReader(channel, TIMEOUT_MS, dwHungMs)
+		, records(0), bad(0), abandoned(0), stuck(0), dropped(0)
+	{}
+	long records;
+	long bad;
+	long abandoned;
+	long stuck;
+	uint64_t dropped;
+protected:
+	virtual void onrecord(const LogChannelRecord& rec, const void* data)
+	{
+		records++;
+		const char* p = (const char*)data;
+		long seq = 0;
+		unsigned int len = 0;
+		size_t hdr = ::strnlen(p, rec.length);
+		if (hdr == rec.length || ::sscanf(p, "%ld %u", &seq, &len) != 2
+			|| rec.length != hdr + 1 + len) {
+			bad++;
+			return;
+		}
+		for (unsigned int i=0; i<len; i++) {
+			if ((unsigned char)p[hdr+1+i] != (unsigned char)((seq+i) & 0xff)) {
+				bad++;
+				return;
+			}
+		}
+		std::map<unsigned long, long>::iterator it = last_.find(rec.tid);
+		if (it != last_.end() && seq <= it->second)
+			bad++;
+		last_[rec.tid] = seq;
+	}
+	virtual void onabandoned(unsigned long /*pid*/, uint32_t /*cells*/)
+	{ abandoned++; }
+	virtual void onstuck(unsigned long /*pid*/, uint32_t /*cells*/)
+	{ stuck++; }
+	virtual void ondropped(uint64_t count)
+	{ dropped += count; }
+private:
+	std::map<unsigned long, long> last_;	// last sequence seen, per thread
+};
+
+// maps the raw segment, for forcing the awkward cases
+struct RawChannel {
+	SharedMemory shm;
+	LogChannelHeader* header;
+	RawChannel()
+	{
+		shm.open(CHANNEL_NAME, sizeof(LogChannelHeader) + (size_t)CELL_COUNT*CELL_SIZE);
+		header = (LogChannelHeader*)shm.data();
+	}
+	LogChannelCell* cell(uint64_t pos)
+	{ return (LogChannelCell*)((char*)shm.data() + sizeof(LogChannelHeader) + (size_t)(pos & (CELL_COUNT-1))*CELL_SIZE); }
+	// reserves cells the way LogChannel::write() does, waiting for room
+	uint64_t reserve(uint32_t cells)
+	{
+		uint64_t pos = header->enqueuePos.load();
+		for (;;) {
+			uint32_t i = 0;
+			while (i < cells && cell(pos + i)->seq.load() == LogChannel::seqFree(pos + i))
+				i++;
+			if (i == cells && header->enqueuePos.compare_exchange_weak(pos, pos + cells))
+				return pos;
+			pos = header->enqueuePos.load();
+			std::this_thread::yield();
+		}
+	}
+	// takes the reserved cells the way LogChannel::write() does
+	void take(uint64_t pos, uint32_t cells)
+	{
+		uint64_t timestamp = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		for (uint32_t i=0; i<cells; i++) {
+			LogChannelCell* taken = cell(pos + i);
+			uint64_t expected = LogChannel::seqFree(pos + i);
+			if (!taken->seq.compare_exchange_strong(expected, LogChannel::seqWriting(::getpid())))
+				::_exit(2);
+			taken->timestamp = timestamp;
+			taken->claim.store(pos + i);
+		}
+	}
+};
+
+static size_t g_cbPage;
+
+// Stops the process on touching a protected page, then lets the access
+// through once the parent has continued it.
+static void stopOnFault(int, siginfo_t* si, void*)
+{
+	::kill(::getpid(), SIGSTOP);
+	::mprotect((void*)((uintptr_t)si->si_addr & ~(uintptr_t)(g_cbPage-1)), g_cbPage, PROT_READ|PROT_WRITE);
+}
+
+/*
+ * Writes RECORDS records from each of THREADS threads. fStop has a few
+ * of each thread's records handed to write() straddling a protected page,
+ * which stops the producer as write() copies the payload -- right in the
+ * middle of the record -- until the parent continues it.
+ */
+static void produce(int id, bool fDie, bool fStop=false)
+{
+	LogChannel channel;
+	if (!channel.open(CHANNEL_NAME, CELL_COUNT, CELL_SIZE))
+		::_exit(2);
+	if (fStop) {
+		g_cbPage = (size_t)::sysconf(_SC_PAGESIZE);
+		struct sigaction sa;
+		::memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = stopOnFault;
+		sa.sa_flags = SA_SIGINFO|SA_RESTART;
+		::sigaction(SIGSEGV, &sa, NULL);
+	}
+	// payload byte i of record seq is (seq+i) & 0xff, copied from here
+	static char pattern[256+700];
+	for (size_t i=0; i<sizeof(pattern); i++)
+		pattern[i] = (char)(i & 0xff);
+	std::vector<std::thread> threads;
+	for (int t=0; t<THREADS; t++) {
+		threads.push_back(std::thread([&channel, id, fDie, fStop, t]() {
+			char buf[2048];
+			char* trap = fStop ? (char*)::mmap(NULL, 2*g_cbPage, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0) : NULL;
+			for (long seq=0; seq<RECORDS; seq++) {
+				unsigned int len = (unsigned int)((seq*37 + id + t) % 700);
+				int hdr = ::sprintf(buf, "%ld %u", seq, len);
+				::memcpy(buf+hdr+1, pattern + (seq & 0xff), len);
+				const char* rec = buf;
+				if (trap && seq % (RECORDS/4) == RECORDS/8) {
+					// second half of the record on a page of its own, protected
+					char* p = trap + g_cbPage - (hdr+1+len)/2;
+					::mprotect(trap + g_cbPage, g_cbPage, PROT_READ|PROT_WRITE);
+					::memcpy(p, buf, hdr+1+len);
+					::mprotect(trap + g_cbPage, g_cbPage, PROT_NONE);
+					rec = p;
+				}
+				while (!channel.write(rec, hdr+1+len))
+					std::this_thread::yield();
+				if (fDie && seq == RECORDS/2)
+					::kill(::getpid(), SIGKILL);
+			}
+		}));
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+	::_exit(0);
+}
+
+// reserves cells and dies, with or without taking the first cell
+static void orphan(bool fClaim)
+{
+	RawChannel raw;
+	::usleep(20000);
+	uint64_t pos = raw.reserve(3);
+	if (fClaim)
+		raw.take(pos, 1);
+	::_exit(0);
+}
+
+// reserves and takes all the cells of a record, then stops
+static void hang()
+{
+	RawChannel raw;
+	raw.take(raw.reserve(3), 3);
+	::raise(SIGSTOP);
+	::_exit(0);
+}
+
+static bool check(bool fOk, const char* what)
+{
+	printf("%-60s %s\n", what, fOk ? "ok" : "FAILED");
+	return fOk;
+}
+
+static bool testProducers()
+{
+	LogChannel channel;
+	if (!channel.open(CHANNEL_NAME, CELL_COUNT, CELL_SIZE))
+		return check(false, "open channel");
+	CheckingReader reader(channel);
+	if (!reader.attach())
+		return check(false, "attach reader");
+
+	int children = 0;
+	for (int i=0; i<PRODUCERS; i++) {
+		if (::fork() == 0)
+			produce(i, i == 0);
+		children++;
+	}
+	if (::fork() == 0)
+		orphan(false);
+	if (::fork() == 0)
+		orphan(true);
+	children += 2;
+
+	::alarm(60);
+	while (children) {
+		reader.drain();
+		int status;
+		if (::waitpid(-1, &status, WNOHANG) > 0)
+			children--;
+	}
+	// give the stuck records time to time out
+	for (int i=0; i<(int)(2*TIMEOUT_MS/10); i++) {
+		reader.drain();
+		SharedMemory::sleep(10);
+	}
+	::alarm(0);
+
+	long expected = (long)(PRODUCERS-1)*THREADS*RECORDS;
+	printf("records=%ld bad=%ld abandoned=%ld dropped(retried)=%llu\n",
+		reader.records, reader.bad, reader.abandoned, (unsigned long long)reader.dropped);
+	bool fOk = check(reader.bad == 0, "records intact and in order per thread");
+	fOk = check(reader.records >= expected && reader.records <= expected + THREADS*(RECORDS/2+1),
+		"all records from the surviving producers read") && fOk;
+	// Three for the orphans, as the one that took its first cell leaves
+	// the rest to time out. The SIGKILL may catch each of the threads of
+	// that producer in the middle of a record, likewise.
+	fOk = check(reader.abandoned >= 3 && reader.abandoned <= 3 + 2*THREADS, "orphaned records abandoned") && fOk;
+	return fOk;
+}
+
+static bool testHungWriter()
+{
+	LogChannel channel;
+	if (!channel.open(CHANNEL_NAME, CELL_COUNT, CELL_SIZE))
+		return check(false, "open channel");
+	CheckingReader reader(channel);
+	if (!reader.attach())
+		return check(false, "attach reader");
+
+	pid_t hung = ::fork();
+	if (hung == 0)
+		hang();
+	int status;
+	::waitpid(hung, &status, WUNTRACED);
+
+	// a producer that laps the ring many times over, past the stopped one
+	pid_t producer = ::fork();
+	if (producer == 0)
+		produce(0, false);
+	::alarm(60);
+	for (;;) {
+		reader.drain();
+		if (::waitpid(producer, &status, WNOHANG) > 0)
+			break;
+	}
+	reader.drain();
+	::alarm(0);
+	printf("records=%ld bad=%ld stuck=%ld parked=%u\n",
+		reader.records, reader.bad, reader.stuck, reader.getParkedCount());
+	bool fOk = check(reader.bad == 0 && reader.records == THREADS*RECORDS, "records read past a stopped writer");
+	fOk = check(reader.stuck == 1 && reader.getParkedCount() == 3, "stopped writer's cells parked") && fOk;
+
+	// once the writer is gone, its cells are freed for use again
+	::kill(hung, SIGKILL);
+	::waitpid(hung, &status, 0);
+	for (int i=0; i<(int)(2*TIMEOUT_MS/10); i++) {
+		reader.drain();
+		SharedMemory::sleep(10);
+	}
+	fOk = check(reader.getParkedCount() == 0, "parked cells freed once the writer is gone") && fOk;
+
+	// and the ring works as before, all the cells taking records again
+	char buf[64];
+	long records = reader.records;
+	for (long seq=0; seq<(long)CELL_COUNT*4; seq++) {
+		int hdr = ::sprintf(buf, "%ld %u", seq, 0u);
+		if (!channel.write(buf, hdr+1))
+			break;
+		reader.drain();
+	}
+	fOk = check(reader.bad == 0 && reader.records - records == (long)CELL_COUNT*4, "ring reused after freeing the parked cells") && fOk;
+	return fOk;
+}
+
+static bool testStoppedProducers()
+{
+	LogChannel channel;
+	if (!channel.open(CHANNEL_NAME, CELL_COUNT, CELL_SIZE))
+		return check(false, "open channel");
+	const unsigned int hungMs = 50;
+	CheckingReader reader(channel, hungMs);
+	if (!reader.attach())
+		return check(false, "attach reader");
+
+	// The producers stop themselves in the middle of a record every so
+	// often, see produce(). They are continued once stopped for longer
+	// than hungMs, then drop the record and write it again.
+	const int producers = 3;
+	pid_t pids[producers];
+	std::chrono::steady_clock::time_point stoppedAt[producers];
+	bool fStopped[producers];
+	for (int i=0; i<producers; i++) {
+		pids[i] = ::fork();
+		if (pids[i] == 0)
+			produce(i, false, true);
+		fStopped[i] = false;
+	}
+	::alarm(120);
+	int children = producers;
+	int stops = 0;
+	while (children) {
+		reader.drain();
+		for (int i=0; i<producers; i++) {
+			if (pids[i] == 0)
+				continue;
+			int status;
+			if (::waitpid(pids[i], &status, WNOHANG|WUNTRACED) == pids[i]) {
+				if (WIFSTOPPED(status)) {
+					fStopped[i] = true;
+					stoppedAt[i] = std::chrono::steady_clock::now();
+					stops++;
+				} else {
+					pids[i] = 0;
+					children--;
+					continue;
+				}
+			}
+			if (fStopped[i] && std::chrono::steady_clock::now() - stoppedAt[i] > std::chrono::milliseconds(3*hungMs)) {
+				fStopped[i] = false;
+				::kill(pids[i], SIGCONT);
+			}
+		}
+	}
+	reader.drain();
+	::alarm(0);
+
+	printf("records=%ld bad=%ld stuck=%ld abandoned=%ld dropped(retried)=%llu stops=%d\n",
+		reader.records, reader.bad, reader.stuck, reader.abandoned, (unsigned long long)reader.dropped, stops);
+	bool fOk = check(reader.bad == 0, "records intact and in order per thread");
+	fOk = check(reader.records == (long)producers*THREADS*RECORDS, "every record read exactly once") && fOk;
+	fOk = check(reader.stuck > 0, "stopped writers parked") && fOk;
+	return fOk;
+}
+
+static bool testReaderTakeover()
+{
+	LogChannel channel;
+	if (!channel.open(CHANNEL_NAME, CELL_COUNT, CELL_SIZE))
+		return check(false, "open channel");
+
+	// a few records, the first of them spanning several cells
+	char buf[600];
+	::memset(buf, 0, sizeof(buf));
+	for (long seq=0; seq<10; seq++) {
+		unsigned int len = seq == 0 ? 500 : 10;
+		int hdr = ::sprintf(buf, "%ld %u", seq, len);
+		for (unsigned int i=0; i<len; i++)
+			buf[hdr+1+i] = (char)((seq+i) & 0xff);
+		channel.write(buf, hdr+1+len);
+	}
+
+	// a reader that dies in release(), after handing back the cells of
+	// the first record but before moving dequeuePos past them
+	pid_t pid = ::fork();
+	if (pid == 0) {
+		CheckingReader reader(channel);
+		if (!reader.attach())
+			::_exit(2);
+		RawChannel raw;
+		uint64_t pos = raw.header->dequeuePos.load();
+		uint32_t cells = raw.cell(pos)->cells;
+		for (uint32_t i=0; i<cells; i++)
+			raw.cell(pos + i)->seq.store(LogChannel::seqFree(pos + i + CELL_COUNT));
+		::_exit(0);
+	}
+	int status;
+	::waitpid(pid, &status, 0);
+
+	CheckingReader reader(channel);
+	bool fOk = check(reader.attach(), "take over from a dead reader");
+	::alarm(10);
+	for (int i=0; i<(int)(2*TIMEOUT_MS/10); i++) {
+		reader.drain();
+		SharedMemory::sleep(10);
+	}
+	::alarm(0);
+	fOk = check(reader.bad == 0 && reader.records == 9, "records after a half released one read") && fOk;
+
+	// a detached reader leaves the channel free for the next one
+	reader.detach();
+	fOk = check(reader.attach(), "reattach after detach") && fOk;
+	return fOk;
+}
+
+int main()
+{
+	SharedMemory::remove(CHANNEL_NAME);
+	bool fOk = testProducers();
+	SharedMemory::remove(CHANNEL_NAME);
+	fOk = testHungWriter() && fOk;
+	SharedMemory::remove(CHANNEL_NAME);
+	fOk = testStoppedProducers() && fOk;
+	SharedMemory::remove(CHANNEL_NAME);
+	fOk = testReaderTakeover() && fOk;
+	SharedMemory::remove(CHANNEL_NAME);
+	printf("%s\n", fOk ? "PASSED" : "FAILED");
+	return fOk ? 0 : 1;
+}
@@ -20,6 +20,12 @@
  *
  * 12/7/11  Hari
  *      - Added stream interface to LogWriter
+ *
+ * 10/18/26
+ *      - Added lock instrumentation and an emergency write path to Logger,
+ *        for use by the service watchdog
+ *      - Added Logger::writeraw(), for writing out records drained from a
+ *        log channel (see chanlog.h)
  */
 
 #pragma once
@@ -56,6 +62,7 @@ class Logger {
 		CriticalSection() { ::InitializeCriticalSection(&m_cs); }
 		~CriticalSection() { ::DeleteCriticalSection(&m_cs); }
 		void Lock() { ::EnterCriticalSection(&m_cs); }
+		bool TryLock() { return ::TryEnterCriticalSection(&m_cs) != FALSE; }
 		void Unlock() { ::LeaveCriticalSection(&m_cs); }
 	};
 	// RAII class for a multithread syncing lock
@@ -65,6 +72,26 @@ class Logger {
 		AutoLock(CriticalSection& cs) : m_cs(cs) { m_cs.Lock(); }
 		~AutoLock() { m_cs.Unlock(); }
 	};
+	// RAII class that records how long the lock is held. Has to be
+	// declared after the AutoLock so that it goes out of scope first.
+	class LockTimer {
+		Logger& m_logger;
+	public:
+		LockTimer(Logger& logger) : m_logger(logger)
+		{
+			// 0 means 'not held', so skip it on tick count wraparound
+			DWORD dwNow = ::GetTickCount();
+			::InterlockedExchange(&m_logger.lockedsince_, dwNow ? (LONG)dwNow : 1);
+		}
+		~LockTimer()
+		{
+			LONG lHeld = (LONG)(::GetTickCount() - (DWORD)m_logger.lockedsince_);
+			::InterlockedExchange(&m_logger.lockedsince_, 0);
+			// only one thread can be here at a time, so no CAS loop needed
+			if (lHeld > m_logger.maxlockhold_)
+				::InterlockedExchange(&m_logger.maxlockhold_, lHeld);
+		}
+	};
 public:
 	// predefined logging levels
 	static const int LOG_LEVEL_ERROR=10;
@@ -76,6 +103,10 @@ public:
     Logger()
 		: sync_()
 		, lastmsgtime_(0)
+		, fTimeLines_(true)
+		, waiters_(0)
+		, lockedsince_(0)
+		, maxlockhold_(0)
 #ifdef _DEBUG
 		, level_(LOG_LEVEL_DEBUG)
 #else
@@ -100,12 +131,60 @@ public:
 	{
 		writecomposed(level, tag, msg);
 	}
+	// writes an already formatted message as is, level is not checked
+	void writeraw(wchar_t const* msg)
+	{
+		::InterlockedIncrement(&waiters_);
+		AutoLock l(sync_);
+		::InterlockedDecrement(&waiters_);
+		LockTimer t(*this);
+		actualwrite(msg);
+	}
 	// get/set logging level
     void setLevel(int level)
     { level_ = level; }
 	int getLevel()
     { return level_; }
 
+	/*
+	 * Lock instrumentation. These can be called from any thread without
+	 * taking the lock and are meant for diagnosing a logger that has
+	 * become a bottleneck, say due to a slow disk.
+	 */
+	// number of threads currently waiting to acquire the lock
+	LONG getWaiterCount() const
+	{ return waiters_; }
+	// milliseconds the current holder has held the lock, 0 if it's free
+	DWORD getLockHeldFor() const
+	{
+		LONG since = lockedsince_;
+		return since ? ::GetTickCount() - (DWORD)since : 0;
+	}
+	// longest time, in milliseconds, that the lock has been held since
+	// the last call, starts over with every call
+	DWORD resetMaxLockHold()
+	{ return (DWORD)::InterlockedExchange(&maxlockhold_, 0); }
+
+	/*
+	 * Emergency path, for when the regular write() might block. Message
+	 * always goes to the debugger output and is written to the output
+	 * medium only if the lock can be acquired without waiting. Returns
+	 * false if it could not be, leaving it to the caller to find another
+	 * place for it. Level is not checked.
+	 */
+	bool writeemergency(const wchar_t* tag, wchar_t const* msg) throw()
+	{
+		wchar_t finalmsg[MAX_LOG_MESSAGE_LEN+MAX_TAG_LEN+9] = {0};
+		::swprintf_s(finalmsg, _countof(finalmsg), L"%-12s %4d %s\r\n",
+			tag, ::GetCurrentThreadId(), msg);
+		::OutputDebugStringW(finalmsg);
+		if (!sync_.TryLock())
+			return false;
+		actualwrite(finalmsg);
+		sync_.Unlock();
+		return true;
+	}
+
 protected:
 	// fills the argument 1 with timestamp string (time is in local time)
 	// make sure szStamp can hold at least 32 characters. That is, nChars >= 32.
@@ -138,11 +217,14 @@ protected:
         if (level > getLevel())
             return;
 
+		::InterlockedIncrement(&waiters_);
 		AutoLock l(sync_);
+		::InterlockedDecrement(&waiters_);
+		LockTimer t(*this);
 
 		time_t now;
 		now = ::time(NULL);
-		if (now != lastmsgtime_) {
+		if (fTimeLines_ && now != lastmsgtime_) {
 			// last message was written at an earlier time
 			// write out the current date time string
 			wchar_t szTime[64] = {0};
@@ -162,6 +244,11 @@ protected:
 		actualwrite(finalmsg);
 	}
 
+	// Turns the date time line written ahead of every new second's messages
+	// on or off. Off for loggers whose medium timestamps messages itself.
+	void setTimeLines(bool fTimeLines)
+	{ fTimeLines_ = fTimeLines; }
+
 	// the actual log message writer -- derived classes should implement this
 	// to write the message to the output medium.
     virtual void actualwrite(wchar_t const* msg) = 0;
@@ -169,6 +256,10 @@ protected:
 private:
     CriticalSection sync_;	// for thread synchronization
     time_t lastmsgtime_;	// time when last message was written
+    bool fTimeLines_;		// write out date time lines
+    volatile LONG waiters_;		// threads blocked on sync_
+    volatile LONG lockedsince_;	// tick count when sync_ was taken, 0 if free
+    volatile LONG maxlockhold_;	// longest sync_ hold time, in milliseconds
     int level_;				// logging level, an iteger. meaning of different levels
 							// to be decided by the class clients.
 };
@@ -0,0 +1,306 @@
+/**
+ * File         : shmem.h
+ * Purpose      : Portable named shared memory segments.
+ *
+ * A thin wrapper over file mappings on Windows and POSIX shared memory
+ * elsewhere, along with the handful of process helpers that code living
+ * in shared memory needs. Kept free of any Windows-only types so that
+ * whatever is built on top of it can be exercised on Linux as well.
+ *
+ * On Windows, segments shared between a service and processes in other
+ * sessions need a "Global\" prefixed name. Such a segment is created by
+ * the service's account, so it must also be opened up to the accounts
+ * the other processes run under, see open(). On POSIX, the name is mapped
+ * to a valid shm object name by prefixing it with '/' and replacing any
+ * path separators with '_'.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <sddl.h>
+#pragma comment(lib, "advapi32.lib")
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#endif
+
+class SharedMemory {
+	SharedMemory(const SharedMemory&);
+	SharedMemory& operator=(const SharedMemory&);
+public:
+	SharedMemory()
+		: pData_(0)
+		, cbSize_(0)
+		, fCreator_(false)
+#ifdef _WIN32
+		, hMapping_(NULL)
+#else
+		, fd_(-1)
+#endif
+	{}
+	~SharedMemory()
+	{ close(); }
+
+	/*
+	 * Opens the named segment, creating it with cbSize bytes if it does
+	 * not exist. A newly created segment is zero filled. isCreator() tells
+	 * whether this call created the segment. Returns false on failure.
+	 *
+	 * By default only the creator's account (and on Windows, SYSTEM and
+	 * the administrators) can open the segment. With fAllUsers, a segment
+	 * created by this call can be read and written by all authenticated
+	 * users, which is what a service sharing it with helper processes
+	 * running under other accounts needs.
+	 */
+	bool open(const char* name, size_t cbSize, bool fAllUsers=false)
+	{
+		close();
+#ifdef _WIN32
+		SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, FALSE };
+		if (fAllUsers && !::ConvertStringSecurityDescriptorToSecurityDescriptorW(
+				L"D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;GRGW;;;AU)", SDDL_REVISION_1, &sa.lpSecurityDescriptor, NULL))
+			return false;
+		hMapping_ = ::CreateFileMappingA(INVALID_HANDLE_VALUE, fAllUsers ? &sa : NULL, PAGE_READWRITE,
+			(DWORD)((unsigned long long)cbSize >> 32), (DWORD)cbSize, name);
+		DWORD dwError = ::GetLastError();
+		if (sa.lpSecurityDescriptor)
+			::LocalFree(sa.lpSecurityDescriptor);
+		if (hMapping_ == NULL) {
+			// Exists, but CreateFileMapping() asks for full access, which the
+			// segment's DACL need not grant us. Read/write is all we need.
+			if (dwError != ERROR_ACCESS_DENIED)
+				return false;
+			hMapping_ = ::OpenFileMappingA(FILE_MAP_READ|FILE_MAP_WRITE, FALSE, name);
+			if (hMapping_ == NULL)
+				return false;
+			dwError = ERROR_ALREADY_EXISTS;
+		}
+		fCreator_ = dwError != ERROR_ALREADY_EXISTS;
+		pData_ = ::MapViewOfFile(hMapping_, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, cbSize);
+#else
+		std::string shmname = getPosixName(name);
+		mode_t mode = fAllUsers ? 0666 : 0600;
+		fd_ = ::shm_open(shmname.c_str(), O_RDWR|O_CREAT|O_EXCL, mode);
+		if (fd_ != -1) {
+			fCreator_ = true;
+			// shm_open() is subject to the umask
+			if (::fchmod(fd_, mode) != 0 || ::ftruncate(fd_, (off_t)cbSize) != 0) {
+				close();
+				::shm_unlink(shmname.c_str());
+				return false;
+			}
+		} else if (errno == EEXIST) {
+			fd_ = ::shm_open(shmname.c_str(), O_RDWR, mode);
+			if (fd_ == -1 || !waitForSize(cbSize)) {
+				close();
+				return false;
+			}
+		} else {
+			return false;
+		}
+		pData_ = ::mmap(NULL, cbSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd_, 0);
+		if (pData_ == MAP_FAILED)
+			pData_ = 0;
+#endif
+		if (pData_ == 0) {
+			close();
+			return false;
+		}
+		cbSize_ = cbSize;
+		return true;
+	}
+	// unmaps the segment, the segment itself lives on until removed
+	void close()
+	{
+#ifdef _WIN32
+		if (pData_)
+			::UnmapViewOfFile(pData_);
+		if (hMapping_ != NULL)
+			::CloseHandle(hMapping_);
+		hMapping_ = NULL;
+#else
+		if (pData_)
+			::munmap(pData_, cbSize_);
+		if (fd_ != -1)
+			::close(fd_);
+		fd_ = -1;
+#endif
+		pData_ = 0;
+		cbSize_ = 0;
+		fCreator_ = false;
+	}
+
+	void* data() const
+	{ return pData_; }
+	size_t size() const
+	{ return cbSize_; }
+	bool isCreator() const
+	{ return fCreator_; }
+
+	/*
+	 * Removes the segment's name so that the next open() creates a fresh
+	 * one. A no-op on Windows, where the segment goes away along with the
+	 * last handle to it.
+	 */
+	static void remove(const char* name)
+	{
+#ifndef _WIN32
+		::shm_unlink(getPosixName(name).c_str());
+#endif
+	}
+
+	/*
+	 * Process helpers
+	 */
+	static unsigned long currentProcessId()
+	{
+#ifdef _WIN32
+		return ::GetCurrentProcessId();
+#else
+		return (unsigned long)::getpid();
+#endif
+	}
+	static unsigned long currentThreadId()
+	{
+#ifdef _WIN32
+		return ::GetCurrentThreadId();
+#else
+		return (unsigned long)::syscall(SYS_gettid);
+#endif
+	}
+	/*
+	 * Is the given process still around? Errs on the side of 'alive' when
+	 * it can't tell, say for lack of access rights.
+	 *
+	 * A pid can be reused once its process is gone. If startedBy, in
+	 * nanoseconds since the epoch, is given, a process by that pid that
+	 * was started after it is taken for a different one, and so the one
+	 * asked about for dead.
+	 */
+	static bool isProcessAlive(unsigned long pid, uint64_t startedBy=0)
+	{
+		if (pid == 0)
+			return false;
+#ifdef _WIN32
+		HANDLE hProcess = ::OpenProcess(SYNCHRONIZE, FALSE, pid);
+		if (hProcess == NULL)
+			return ::GetLastError() == ERROR_ACCESS_DENIED;
+		bool fAlive = ::WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT;
+		::CloseHandle(hProcess);
+#else
+		bool fAlive = ::kill((pid_t)pid, 0) == 0 || errno == EPERM;
+#endif
+		if (fAlive && startedBy != 0) {
+			uint64_t started = getProcessStartTime(pid);
+			if (started != 0 && started > startedBy + START_TIME_SLACK_NS)
+				return false;
+		}
+		return fAlive;
+	}
+	// When the process was started, in nanoseconds since the epoch, 0 if
+	// that can't be told.
+	static uint64_t getProcessStartTime(unsigned long pid)
+	{
+#ifdef _WIN32
+		HANDLE hProcess = ::OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+		if (hProcess == NULL)
+			return 0;
+		FILETIME ftCreation, ftExit, ftKernel, ftUser;
+		BOOL fOk = ::GetProcessTimes(hProcess, &ftCreation, &ftExit, &ftKernel, &ftUser);
+		::CloseHandle(hProcess);
+		if (!fOk)
+			return 0;
+		ULARGE_INTEGER li;
+		li.LowPart = ftCreation.dwLowDateTime;
+		li.HighPart = ftCreation.dwHighDateTime;
+		return (li.QuadPart - 116444736000000000ULL) * 100;	// FILETIME epoch is 1601
+#elif defined(__linux__)
+		// field 22 of /proc/<pid>/stat, in clock ticks since boot
+		char szPath[64];
+		::snprintf(szPath, sizeof(szPath), "/proc/%lu/stat", pid);
+		FILE* fp = ::fopen(szPath, "r");
+		if (!fp)
+			return 0;
+		char szStat[1024] = {0};
+		size_t cb = ::fread(szStat, 1, sizeof(szStat)-1, fp);
+		::fclose(fp);
+		szStat[cb] = 0;
+		// the command name, field 2, is in parentheses and may hold spaces
+		const char* p = ::strrchr(szStat, ')');
+		unsigned long long ticks = 0;
+		if (!p || ::sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &ticks) != 1)
+			return 0;
+		long hz = ::sysconf(_SC_CLK_TCK);
+		struct timespec real, boot;
+		if (hz <= 0 || ::clock_gettime(CLOCK_REALTIME, &real) != 0 || ::clock_gettime(CLOCK_BOOTTIME, &boot) != 0)
+			return 0;
+		int64_t booted = ((int64_t)real.tv_sec - boot.tv_sec) * 1000000000LL + (real.tv_nsec - boot.tv_nsec);
+		return (uint64_t)(booted + (int64_t)(ticks * (1000000000ULL / (unsigned long long)hz)));
+#else
+		(void)pid;
+		return 0;
+#endif
+	}
+	static void sleep(unsigned int ms)
+	{
+#ifdef _WIN32
+		::Sleep(ms);
+#else
+		struct timespec ts = { (time_t)(ms/1000), (long)(ms%1000)*1000000L };
+		::nanosleep(&ts, NULL);
+#endif
+	}
+
+private:
+	// Allowance for the start time being off, as the system clock can be
+	// set back after a process starts. On Linux, it's also only known to a
+	// clock tick and relative to a boot time worked out from two clocks.
+	static const uint64_t START_TIME_SLACK_NS = 10000000000ULL;
+
+#ifndef _WIN32
+	static std::string getPosixName(const char* name)
+	{
+		std::string shmname("/");
+		for (const char* p = name; *p; p++)
+			shmname += (*p == '\\' || *p == '/') ? '_' : *p;
+		return shmname;
+	}
+	// the creator sizes the segment after creating it, give it a moment
+	bool waitForSize(size_t cbSize)
+	{
+		for (int i=0; i<1000; i++) {
+			struct stat st;
+			if (::fstat(fd_, &st) != 0)
+				return false;
+			if ((size_t)st.st_size >= cbSize)
+				return true;
+			sleep(1);
+		}
+		return false;
+	}
+#endif
+
+private:
+	void* pData_;		// mapped view
+	size_t cbSize_;		// size of the mapped view
+	bool fCreator_;		// true if open() created the segment
+#ifdef _WIN32
+	HANDLE hMapping_;	// file mapping object
+#else
+	int fd_;			// shm object descriptor
+#endif
+};
@@ -0,0 +1,262 @@
+/**
+ * File         : watchdog.h
+ * Purpose      : Hang and stall detection for services.
+ *
+ * A service can sit in SERVICE_RUNNING state for ever while its main loop
+ * or one of its workers is stuck, say behind the logger's lock while the
+ * disk is slow. Watchdog catches these.
+ *
+ * Each participant (the run loop, a worker thread, ...) registers itself
+ * and gets back a slot id. It then calls beat() on every iteration of its
+ * loop, which does no more than stamp an interlocked tick count. A monitor
+ * thread wakes up periodically and checks each participant's last beat
+ * against its deadline. The logger is watched too, though it doesn't
+ * beat -- its lock hold time is checked against the logger deadline.
+ *
+ * Diagnostics are written through Logger::writeemergency() so that a
+ * stalled logger doesn't stall the watchdog as well. When the logger's
+ * lock is taken, which it is whenever the logger is the one stalled, they
+ * go to the Application event log instead, if an event source has been
+ * set. Besides the stalls, beat() also tracks the longest gap between two
+ * beats so that latency spikes shorter than the monitor interval are
+ * reported too.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <crtdbg.h>
+#include "logfmwk.h"
+
+#define MAX_WATCHDOG_PARTICIPANTS   32
+#define MAX_PARTICIPANT_NAME_LEN    31
+#define MIN_WATCHDOG_DEADLINE_MS    100	// shorter ones are lost in scheduling noise
+
+class Watchdog {
+	Watchdog();
+	Watchdog(const Watchdog&);
+	Watchdog& operator=(const Watchdog&);
+
+	// participant slot states
+	static const LONG SLOT_FREE=0;
+	static const LONG SLOT_BUSY=1;		// being (un)registered
+	static const LONG SLOT_ACTIVE=2;
+
+	struct Slot {
+		volatile LONG state;		// one of SLOT_xxx
+		volatile LONG lastbeat;		// tick count of last beat
+		volatile LONG maxgap;		// longest gap between beats since last check
+		DWORD dwDeadlineMs;			// maximum permissible gap between beats
+		wchar_t szName[MAX_PARTICIPANT_NAME_LEN+1];
+		// rest are touched only by the monitor thread
+		bool fStalled;				// stall has been reported
+		LONG stalledbeat;			// lastbeat at the time of the stall
+	};
+
+public:
+	// Stall handler, called from the monitor thread after the diagnostics
+	// have been logged.
+	typedef void (CALLBACK *PFNSTALLHANDLER)(LPVOID lpContext, const wchar_t* lpszParticipant, DWORD dwStalledMs);
+
+	Watchdog(Logger& logger)
+		: logger_(logger)
+		, hThread_(NULL)
+		, hEventQuit_(NULL)
+		, dwPollMs_(1000)
+		, dwLoggerDeadlineMs_(0)
+		, fLoggerStalled_(false)
+		, pfnStall_(NULL)
+		, lpContext_(NULL)
+		, hEventSource_(NULL)
+		, dwMaxLockHold_(0)
+	{
+		::ZeroMemory((PVOID)slots_, sizeof(slots_));
+		hEventQuit_ = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+		_ASSERTE(hEventQuit_ != NULL);
+	}
+	~Watchdog()
+	{
+		stop();
+		::CloseHandle(hEventQuit_);
+		if (hEventSource_ != NULL)
+			::DeregisterEventSource(hEventSource_);
+	}
+
+	/*
+	 * Registers a participant, returns its slot id or -1 if all the slots
+	 * are taken or dwDeadlineMs is less than MIN_WATCHDOG_DEADLINE_MS.
+	 * Participant is expected to call beat() at least once every
+	 * dwDeadlineMs milliseconds.
+	 */
+	int add(const wchar_t* lpszName, DWORD dwDeadlineMs) throw()
+	{
+		if (dwDeadlineMs < MIN_WATCHDOG_DEADLINE_MS)
+			return -1;
+		for (int i=0; i<MAX_WATCHDOG_PARTICIPANTS; i++) {
+			Slot& slot = slots_[i];
+			if (::InterlockedCompareExchange(&slot.state, SLOT_BUSY, SLOT_FREE) != SLOT_FREE)
+				continue;
+			::wcsncpy_s(slot.szName, lpszName, _TRUNCATE);
+			slot.dwDeadlineMs = dwDeadlineMs;
+			slot.fStalled = false;
+			slot.stalledbeat = 0;
+			::InterlockedExchange(&slot.maxgap, 0);
+			::InterlockedExchange(&slot.lastbeat, (LONG)::GetTickCount());
+			::InterlockedExchange(&slot.state, SLOT_ACTIVE);
+			return i;
+		}
+		return -1;
+	}
+	void remove(int id) throw()
+	{
+		if (id >= 0 && id < MAX_WATCHDOG_PARTICIPANTS)
+			::InterlockedCompareExchange(&slots_[id].state, SLOT_FREE, SLOT_ACTIVE);
+	}
+
+	// the heartbeat, cheap enough to be called from any loop
+	void beat(int id) throw()
+	{
+		if (id < 0 || id >= MAX_WATCHDOG_PARTICIPANTS)
+			return;
+		Slot& slot = slots_[id];
+		DWORD dwNow = ::GetTickCount();
+		LONG gap = (LONG)(dwNow - (DWORD)::InterlockedExchange(&slot.lastbeat, (LONG)dwNow));
+		// benign race with the monitor resetting maxgap, worst case a
+		// spike gets reported in the next interval
+		if (gap > slot.maxgap)
+			::InterlockedExchange(&slot.maxgap, gap);
+	}
+
+	// event log source for the diagnostics that can't go to the logger
+	void setEventSource(const wchar_t* lpszSource)
+	{
+		if (hEventSource_ == NULL)
+			hEventSource_ = ::RegisterEventSourceW(NULL, lpszSource);
+	}
+
+	// maximum time the logger's lock may be held, 0 to not watch the logger
+	void setLoggerDeadline(DWORD dwDeadlineMs)
+	{ dwLoggerDeadlineMs_ = dwDeadlineMs; }
+
+	/*
+	 * Starts the monitor thread, which checks the participants every
+	 * dwPollMs milliseconds. pfnStall, if not NULL, is called for every
+	 * stall detected.
+	 */
+	bool start(DWORD dwPollMs, PFNSTALLHANDLER pfnStall, LPVOID lpContext) throw()
+	{
+		if (hThread_ != NULL)
+			return true;
+		dwPollMs_ = dwPollMs ? dwPollMs : 1;
+		pfnStall_ = pfnStall;
+		lpContext_ = lpContext;
+		// participants may have been registered long before, restart their clocks
+		for (int i=0; i<MAX_WATCHDOG_PARTICIPANTS; i++) {
+			if (slots_[i].state == SLOT_ACTIVE)
+				::InterlockedExchange(&slots_[i].lastbeat, (LONG)::GetTickCount());
+		}
+		::ResetEvent(hEventQuit_);
+		hThread_ = ::CreateThread(NULL, 0, _monitorProc, (LPVOID)this, 0, NULL);
+		return hThread_ != NULL;
+	}
+	void stop() throw()
+	{
+		if (hThread_ == NULL)
+			return;
+		::SetEvent(hEventQuit_);
+		::WaitForSingleObject(hThread_, INFINITE);
+		::CloseHandle(hThread_);
+		hThread_ = NULL;
+	}
+
+//Implementation
+protected:
+	static DWORD WINAPI _monitorProc(LPVOID lpParam)
+	{
+		reinterpret_cast<Watchdog*>(lpParam)->monitor();
+		return 0;
+	}
+	void monitor() throw()
+	{
+		while (::WaitForSingleObject(hEventQuit_, dwPollMs_) == WAIT_TIMEOUT) {
+			// lock hold times are reported per interval, like the beat gaps
+			dwMaxLockHold_ = logger_.resetMaxLockHold();
+			for (int i=0; i<MAX_WATCHDOG_PARTICIPANTS; i++) {
+				if (slots_[i].state == SLOT_ACTIVE)
+					check(slots_[i]);
+			}
+			checkLogger();
+		}
+	}
+	void check(Slot& slot) throw()
+	{
+		LONG lastbeat = slot.lastbeat;
+		DWORD dwSilent = ::GetTickCount() - (DWORD)lastbeat;
+		DWORD dwMaxGap = (DWORD)::InterlockedExchange(&slot.maxgap, 0);
+
+		if (dwSilent > slot.dwDeadlineMs) {
+			if (!slot.fStalled || slot.stalledbeat != lastbeat) {
+				slot.fStalled = true;
+				slot.stalledbeat = lastbeat;
+				report(L"stall", slot.szName, dwSilent, slot.dwDeadlineMs);
+				if (pfnStall_)
+					pfnStall_(lpContext_, slot.szName, dwSilent);
+			}
+		} else if (slot.fStalled) {
+			// beating again, the gap that ended the stall is the spike
+			slot.fStalled = false;
+			report(L"recovered", slot.szName, dwMaxGap, slot.dwDeadlineMs);
+		} else if (dwMaxGap > slot.dwDeadlineMs) {
+			// missed the deadline, but recovered before we got to look
+			report(L"spike", slot.szName, dwMaxGap, slot.dwDeadlineMs);
+		}
+	}
+	void checkLogger() throw()
+	{
+		if (dwLoggerDeadlineMs_ == 0)
+			return;
+		DWORD dwHeld = logger_.getLockHeldFor();
+		if (dwHeld > dwLoggerDeadlineMs_) {
+			if (!fLoggerStalled_) {
+				fLoggerStalled_ = true;
+				report(L"stall", L"logger", dwHeld, dwLoggerDeadlineMs_);
+				if (pfnStall_)
+					pfnStall_(lpContext_, L"logger", dwHeld);
+			}
+		} else {
+			fLoggerStalled_ = false;
+		}
+	}
+	// writes out the stack-free diagnostics for an event
+	void report(const wchar_t* lpszEvent, const wchar_t* lpszName, DWORD dwMs, DWORD dwDeadlineMs) throw()
+	{
+		wchar_t szMsg[256] = {0};
+		::swprintf_s(szMsg, _countof(szMsg),
+			L"%s: participant=%s time=%lums deadline=%lums logger.waiters=%ld logger.lockheld=%lums logger.maxlockhold=%lums",
+			lpszEvent,
+			lpszName,
+			dwMs,
+			dwDeadlineMs,
+			logger_.getWaiterCount(),
+			logger_.getLockHeldFor(),
+			dwMaxLockHold_);
+		if (!logger_.writeemergency(L"watchdog", szMsg) && hEventSource_ != NULL) {
+			const wchar_t* alpszStrings[] = { szMsg };
+			::ReportEventW(hEventSource_, EVENTLOG_WARNING_TYPE, 0, 0, NULL,
+				1, 0, alpszStrings, NULL);
+		}
+	}
+
+private:
+	Logger& logger_;			// for the diagnostics and lock stats
+	HANDLE hThread_;			// monitor thread
+	HANDLE hEventQuit_;			// signals the monitor thread to quit
+	DWORD dwPollMs_;			// monitor interval
+	DWORD dwLoggerDeadlineMs_;	// max logger lock hold time, 0 to disable
+	bool fLoggerStalled_;		// logger stall has been reported
+	PFNSTALLHANDLER pfnStall_;	// stall handler and its context
+	LPVOID lpContext_;
+	HANDLE hEventSource_;		// event log, for when the logger is locked
+	DWORD dwMaxLockHold_;		// longest logger lock hold in this interval
+	Slot slots_[MAX_WATCHDOG_PARTICIPANTS];
+};